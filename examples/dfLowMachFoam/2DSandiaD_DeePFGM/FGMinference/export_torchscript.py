@@ -0,0 +1,52 @@
+# Export the networks to TorchScript and write the metadata dictionary
+# read by DeePFGM with "inference libtorch;". Run in the case directory:
+#   python FGMinference/export_torchscript.py
+import numpy as np
+import torch
+from inference import ResNet, BasicBlock, name_s
+
+networktype = "networks-2D"
+worktype = "data-2D"
+path = "./FGMinference/"
+params = path + worktype + "/process_params/"
+
+def values(a):
+    return "(" + " ".join("%.17g" % v for v in np.ravel(a)) + ")"
+
+# the scaling of every output is stored with the parameters of its network
+phimin = np.zeros(len(name_s))
+phimax = np.zeros(len(name_s))
+lambdas = np.zeros(len(name_s))
+constants = np.zeros(len(name_s))
+
+networks = []
+for name in dict.fromkeys(name_s):
+    outputs = [phinum for phinum, n in enumerate(name_s) if n == name]
+    model = ResNet(BasicBlock, 6, 200, 2, len(outputs))
+    model.load_state_dict(torch.load(path + networktype + "/model_res_" + name + ".pth", map_location="cpu"))
+    model.eval()
+    torch.jit.script(model).save(path + networktype + "/model_res_" + name + ".pt")
+    networks.append((name, outputs))
+    for phinum in outputs:
+        phimin[phinum] = np.load(params + "phimin_" + name + ".npy")[phinum]
+        phimax[phinum] = np.load(params + "phimax_" + name + ".npy")[phinum]
+        lambdas[phinum] = np.load(params + "lambdas_" + name + ".npy")[phinum]
+        constants[phinum] = np.load(params + "constants_" + name + ".npy")[phinum]
+
+with open(path + "DeePFGMMetadata", "w") as f:
+    f.write("FoamFile\n{\n    version     2.0;\n    format      ascii;\n"
+            "    class       dictionary;\n    object      DeePFGMMetadata;\n}\n\n")
+    f.write("dimension   2;\n")
+    f.write("xmin        %s;\n" % values(np.load(params + "xmin.npy")[:2]))
+    f.write("xmax        %s;\n" % values(np.load(params + "xmax.npy")[:2]))
+    f.write("phimin      %s;\n" % values(phimin))
+    f.write("phimax      %s;\n" % values(phimax))
+    f.write("lambdas     %s;\n" % values(lambdas))
+    f.write("constants   %s;\n\n" % values(constants))
+    f.write("networks\n{\n")
+    for name, outputs in networks:
+        f.write("    %s\n    {\n        file    \"%s/model_res_%s.pt\";\n        outputs (%s);\n    }\n"
+                % (name, networktype, name, " ".join(str(o) for o in outputs)))
+    f.write("}\n")
+
+print("written " + path + "DeePFGMMetadata")
@@ -44,17 +44,62 @@ class ResNet(nn.Module):
         out = F.relu(out)
         out = self.output_layer(out)
         return out   
+device = "cuda" if torch.cuda.is_available() else "cpu"
+name_s=["omegac","omegac","omegac","cp","cp","cp","T","T","YH2O","YCO","YCO2"]
+diff_s=[0,0,0,3,3,3,6,6,8,9,10]
 def load_model(phinum):
     phis_s=[3,3,3,3,3,3,2,2,1,1,1]
     networktype="networks-2D"
-    name_s=["omegac","omegac","omegac","cp","cp","cp","T","T","YH2O","YCO","YCO2"]
     name=name_s[phinum]
     model = ResNet(BasicBlock,6,200,2,phis_s[phinum])
-    params = torch.load("./FGMinference/"+networktype+"/model_res_"+name+".pth") # 加载参数
+    params = torch.load("./FGMinference/"+networktype+"/model_res_"+name+".pth",map_location=device) # 加载参数
     model.load_state_dict(params) # 应用到网络结构中
+    model.to(device)
+    model.eval()
     print("load sucess "+name_s[phinum])
     # print(params)
     return model
+# the process parameters are read once
+process_params={}
+def load_params(name):
+    if name not in process_params:
+        path="./FGMinference/data-2D/process_params/"
+        if "x" not in process_params:
+            process_params["x"]=(np.load(path+"xmin.npy"),np.load(path+"xmax.npy"))
+        process_params[name]=(np.load(path+"phimin_"+name+".npy"),np.load(path+"phimax_"+name+".npy"),
+                              np.load(path+"lambdas_"+name+".npy"),np.load(path+"constants_"+name+".npy"))
+    return process_params[name]
+def FGM_batch(x,out,phinums,dimension,models):
+    """Predict the outputs phinums of all the points in one call.
+
+    x: buffer of the features of the points, (z, c, gz, gc, gcz) each
+    out: buffer of one row per output, written in place
+    models: the network of every phinum
+    Every network is evaluated once for all the outputs it predicts.
+    """
+    try:
+        x=np.frombuffer(x,dtype=np.float64).reshape(-1,5)[:,:dimension]
+        out=np.frombuffer(out,dtype=np.float64).reshape(len(phinums),-1)
+        load_params(name_s[phinums[0]])
+        xmin,xmax=process_params["x"]
+        x=(x-xmin[:dimension])/(xmax[:dimension]-xmin[:dimension])
+        x=torch.tensor(x,dtype=torch.float).to(device)
+        predictions={}
+        for r,phinum in enumerate(phinums):
+            name=name_s[phinum]
+            if name not in predictions:
+                with torch.no_grad():
+                    predictions[name]=models[phinum](x).to("cpu").numpy()
+            phimin,phimax,lambdas,constants=load_params(name)
+            result=predictions[name][:,phinum-diff_s[phinum]].astype(np.float64)
+            result=result*(phimax[phinum]-phimin[phinum])+phimin[phinum]
+            result=inv_boxcox(result,lambdas[phinum])-constants[phinum]
+            result[np.isnan(result)]=0
+            out[r]=result
+        return 0
+    except Exception as e:
+        print(e.args)
+        return -1
 def FGM(z,c,gz,gc,gzc,phinum,dimension,models):
     try:
         z=np.array(z)